@@ -2,12 +2,85 @@
 #include "unistd.h"
 #include <cstring>
 #include <sys/mman.h>
+#include <pthread.h>
+#include <signal.h>
+#include <ucontext.h>
+#include <execinfo.h>
+#include <fcntl.h>
+#include <cmath>
+#include <atomic>
 
 #define MDSIZE sizeof(MallocMetadata)
 #define ERROR ((void*)-1)
-#define LARGE_BLOCK ((size_t)128)
+#define EMERGENCY_ALIGN ((size_t)16)
+#define EMERGENCY_SLOTS 64 // one bit each in emergency_slots
+#define NO_TRIM ((size_t)-1)
+#define MAX_MMAP_THRESHOLD ((size_t)(32*1024*1024))
+#define GUARDED_ALIGN ((size_t)16)
+#define GUARD_FILL ((unsigned char)0xab) // slack between the block and its guard page
+#define QUARANTINE_SLOTS 1024
+#define GUARDED_SLOTS 65536 // live guarded blocks, a power of two; vm.max_map_count allows about half
+#define PROFILE_MAX_DEPTH 32
+#define PROFILE_BUCKETS 4096 // distinct sampled call stacks
+#define PROFILE_LIVE_SLOTS 16384 // live sampled blocks, a power of two
+
+// smallopt() parameters, each also settable at startup from the environment variable in the comment
+#define SM_MMAP_THRESHOLD 1  // SMALLOC_MMAP_THRESHOLD
+#define SM_SPLIT_THRESHOLD 2 // SMALLOC_SPLIT_THRESHOLD
+#define SM_TRIM_THRESHOLD 3  // SMALLOC_TRIM_THRESHOLD
+#define SM_QUARANTINE_BYTES 4 // SMALLOC_QUARANTINE_BYTES
+#define SM_PROFILE_RATE 5 // SMALLOC_PROFILE_RATE, 0 turns the heap profiler off
+#define SM_TOP_PAD 6 // SMALLOC_TOP_PAD
+#define SM_DEBUG_RATE 7 // SMALLOC_DEBUG_RATE, must be at least 1
+
+#define BEST_FIT 0
+#define FIRST_FIT 1
+#define NEXT_FIT 2
+
+// Build-time policies. Every one of these can be overridden with -D, e.g.
+// g++ -DFIT_STRATEGY=NEXT_FIT -DCORRUPTION_CHECKS=0 -DHEAP_LOCKING=0 ...
+#ifndef LARGE_BLOCK
+#define LARGE_BLOCK ((size_t)128) // default split threshold
+#endif
+#ifndef MAX_SIZE
 #define MAX_SIZE ((size_t)(1e8))
-#define LARGE_ALLOCATION ((size_t)(128*1024))
+#endif
+#ifndef LARGE_ALLOCATION
+#define LARGE_ALLOCATION ((size_t)(128*1024)) // default mmap threshold
+#endif
+#ifndef TRIM_THRESHOLD
+#define TRIM_THRESHOLD NO_TRIM // default trim threshold
+#endif
+#ifndef TOP_PAD
+#define TOP_PAD ((size_t)(128*1024)) // default bytes kept at the top of the heap when trimming
+#endif
+#ifndef QUARANTINE_BYTES
+#define QUARANTINE_BYTES ((size_t)(64*1024*1024)) // default quarantine size in debug mode
+#endif
+#ifndef DEBUG_RATE
+#define DEBUG_RATE ((size_t)1) // default in debug mode: every allocation is guarded
+#endif
+#ifndef HEAP_CHUNK_MIN
+#define HEAP_CHUNK_MIN ((size_t)(128*1024)) // first reservation of the sbrk heap, doubles on every growth
+#endif
+#ifndef HEAP_CHUNK_MAX
+#define HEAP_CHUNK_MAX ((size_t)(16*1024*1024))
+#endif
+#ifndef PROFILE_RATE
+#define PROFILE_RATE ((size_t)(512*1024)) // default mean bytes between heap profile samples
+#endif
+#ifndef EMERGENCY_POOL_SIZE
+#define EMERGENCY_POOL_SIZE ((size_t)(64*1024)) // a multiple of EMERGENCY_SLOTS * EMERGENCY_ALIGN
+#endif
+#ifndef FIT_STRATEGY
+#define FIT_STRATEGY BEST_FIT
+#endif
+#ifndef CORRUPTION_CHECKS
+#define CORRUPTION_CHECKS 1 // 0 - no cookie checks at all
+#endif
+#ifndef HEAP_LOCKING
+#define HEAP_LOCKING 1 // 0 - single threaded, no mutex and no fork handlers
+#endif
 
 int32_t cookie_val = rand(); // verify this
 
@@ -18,6 +91,9 @@ public:
     int32_t cookie = cookie_val;
     size_t size;
     bool is_free;
+    bool is_mmapped;
+    bool is_guarded; // debug mode block, see allocateGuarded()
+    bool is_sampled; // has an entry in the heap profile live table
     MallocMetadata* next_sorted_size;
     MallocMetadata* prev_by_address;
     MallocMetadata* next_by_address;
@@ -30,6 +106,7 @@ public:
         return this;
     }*/
 };
+struct GuardedBlock;
 
 size_t _num_free_blocks();
 size_t _num_free_bytes();
@@ -40,12 +117,39 @@ size_t _size_meta_data();
 
 void insertToFreeList(MallocMetadata* to_insert);
 void removeFromFreeList(MallocMetadata* to_remove);
+MallocMetadata* findNextFit(size_t size);
 void handleLargeBlock(MallocMetadata* md, size_t size);
 void mergeNextFreeBlock(MallocMetadata* md);
 void mergeFreeBlocks(MallocMetadata* md);
 void* enlargeLastBlock(size_t size, MallocMetadata* top_of_heap);
+bool reserveWilderness(size_t bytes);
+void* carveWilderness(size_t bytes);
+bool canEnlargeTail(size_t delta);
+bool isAdjacent(MallocMetadata* md, MallocMetadata* next);
+size_t shortfall(size_t size, size_t available);
+size_t roundUp(size_t value, size_t alignment);
+void* allocateBlock(size_t size);
+void releaseBlock(void* p);
+void* reallocateBlock(void* oldp, size_t size);
+void lockHeap();
+void unlockHeap();
+void trimHeapTop();
+bool guardNextAllocation();
+void* allocateGuarded(size_t size);
+void releaseGuarded(MallocMetadata* md, GuardedBlock* guarded);
+GuardedBlock* checkGuarded(MallocMetadata* md);
+void reportCorruption(MallocMetadata* md);
+void enableDebugMode();
+void sampleAllocation(void* p, size_t size);
+void recordSample(void* p, size_t size);
+void forgetSample(MallocMetadata* md);
+void removeLiveSample(size_t user);
+int sheap_profile(int fd);
+int setThreshold(int param, size_t value);
+int smallopt(int param, size_t value);
 
 MallocMetadata* head_sorted_size = nullptr;
+MallocMetadata* next_fit_rover = nullptr; // NEXT_FIT only, the free block after the last one handed out
 MallocMetadata* tail_address = nullptr;
 
 size_t num_free_blocks = 0;
@@ -53,19 +157,353 @@ size_t num_free_bytes = 0;
 size_t num_allocated_blocks = 0;
 size_t num_allocated_bytes = 0;
 
+// Blocks are carved from [wilderness_start, wilderness_end), which is reserved
+// from sbrk (or from mmap once sbrk fails) in geometrically growing chunks, so
+// a growing heap costs a syscall per chunk rather than per allocation. initHeap
+// reserves the first chunk before main, so the first allocations - a signal
+// handler's included - are carved without a syscall. The wilderness is not a
+// block and is not counted by the _num_* statistics.
+size_t wilderness_start = 0;
+size_t wilderness_end = 0;
+size_t heap_chunk = HEAP_CHUNK_MIN;
+
+// Runtime thresholds. Until the mmap threshold is set explicitly it adapts:
+// freeing an mmapped block raises it above that block's size, so buffers that
+// are churned at that size move onto the sbrk heap.
+size_t mmap_threshold = LARGE_ALLOCATION;
+size_t split_threshold = LARGE_BLOCK;
+size_t trim_threshold = TRIM_THRESHOLD;
+size_t top_pad = TOP_PAD;
+bool mmap_threshold_fixed = false;
+
+// All of the state above is protected by heap_lock. in_allocator is set for as
+// long as the current thread is inside (or waiting for) the heap, so a nested
+// call - e.g. from a signal handler - is served from the emergency pool instead
+// of re-entering the lists it interrupted.
+pthread_mutex_t heap_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_once_t heap_init_once = PTHREAD_ONCE_INIT;
+__thread bool in_allocator = false;
+
+#define EMERGENCY_SLOT_SIZE (EMERGENCY_POOL_SIZE / EMERGENCY_SLOTS)
+static_assert(EMERGENCY_SLOT_SIZE % EMERGENCY_ALIGN == 0 && EMERGENCY_SLOT_SIZE > EMERGENCY_ALIGN, "EMERGENCY_POOL_SIZE");
+alignas(EMERGENCY_ALIGN) char emergency_pool[EMERGENCY_POOL_SIZE];
+// bit i is set while slot i of the pool is part of a live emergency block, so
+// every block is reused as soon as it is freed, whatever else is still live
+std::atomic<uint64_t> emergency_slots(0);
+std::atomic<MallocMetadata*> deferred_frees(nullptr); // chained by next_sorted_size
+
+// Debug mode (SMALLOC_DEBUG=1): each guarded block gets its own mapping that ends in a
+// PROT_NONE guard page, and freed mappings are protected and held in a FIFO
+// quarantine before being unmapped, so overflows and use after free fault at
+// the offending access. Live guarded blocks are kept in the guarded_blocks table
+// rather than linked through their headers, which sit right before the user
+// pointer: an underflow that overwrites a header is caught when the header is
+// checked against the table, instead of sending sfree down a wild link.
+// Each guarded block costs two mappings (data and guard page) and the kernel caps
+// a process at vm.max_map_count of them, 65530 by default, so at most about 32k
+// guarded blocks can be live - quarantined ones count too. With
+// SMALLOC_DEBUG_RATE=N only every Nth allocation is guarded and the rest come from
+// the normal heap, and an allocation whose guarded mapping fails (or that finds
+// the table full) falls back to the heap as well.
+struct GuardedBlock {
+    size_t user; // 0 - empty slot
+    size_t size;
+};
+
+struct QuarantineEntry {
+    size_t base;
+    size_t data_len; // protected bytes, the guard page follows
+    size_t user;
+    size_t size;
+};
+
+bool debug_mode = false;
+size_t page_size = 0;
+size_t quarantine_limit = QUARANTINE_BYTES;
+size_t debug_rate = DEBUG_RATE;
+size_t allocations_since_guarded = 0;
+GuardedBlock* guarded_blocks = nullptr;
+QuarantineEntry quarantine[QUARANTINE_SLOTS];
+size_t quarantine_first = 0;
+size_t quarantine_count = 0;
+size_t quarantine_bytes = 0;
+__thread const char* current_operation = nullptr; // for fault reports
+struct sigaction previous_segv_action; // whatever the application had installed, chained to on every fault
+struct sigaction previous_bus_action;
+
+// Heap profiler: a call stack is recorded for the allocation that crosses each
+// sampling point, with the distance between points drawn from an exponential
+// distribution of mean profile_rate bytes, so every byte has the same chance to
+// be sampled. Both tables live in their own mapping, never on this heap.
+// recordSample calls backtrace() in whatever context smalloc was called from,
+// signal handlers included; backtrace() is not async-signal-safe, and only the
+// warm-up in initHeapEagerly keeps its first call (which loads libgcc) out of them.
+struct ProfileBucket {
+    size_t depth;
+    void* stack[PROFILE_MAX_DEPTH];
+    size_t alloc_count;
+    size_t alloc_bytes;
+    size_t live_count;
+    size_t live_bytes;
+};
+
+struct LiveSample {
+    size_t user; // 0 - empty slot
+    size_t size;
+    ProfileBucket* bucket;
+};
+
+size_t profile_rate = PROFILE_RATE;
+ProfileBucket* profile_buckets = nullptr;
+LiveSample* live_samples = nullptr;
+size_t profile_dropped = 0;
+__thread size_t bytes_until_sample = 0;
+__thread uint64_t sample_rng = 0;
+
 void exitOnCorruption(MallocMetadata* md)
 {
+#if CORRUPTION_CHECKS
     if(!md)
         return;
     if(md->cookie != cookie_val)
+    {
+        if(debug_mode)
+            reportCorruption(md);
         exit(0xdeadbeef);
+    }
+#else
+    (void)md;
+#endif
+}
+
+// The free list is kept sorted by this key and smalloc takes the first block
+// that fits, so sorting by size gives best fit and sorting by address gives
+// first fit. Next fit also sorts by address but starts at next_fit_rover.
+size_t freeListKey(MallocMetadata* md)
+{
+#if FIT_STRATEGY == FIRST_FIT || FIT_STRATEGY == NEXT_FIT
+    return (size_t)md;
+#else
+    return md->size;
+#endif
+}
+
+void setThresholdFromEnv(int param, const char* name)
+{
+    const char* value = getenv(name);
+    if(value && *value)
+        setThreshold(param, (size_t)strtoull(value, nullptr, 0));
+}
+
+// none of this is async-signal-safe, so it runs from the constructor below
+// rather than from whichever smalloc comes first, which may be in a signal handler
+void initHeap()
+{
+    setThresholdFromEnv(SM_MMAP_THRESHOLD, "SMALLOC_MMAP_THRESHOLD");
+    setThresholdFromEnv(SM_SPLIT_THRESHOLD, "SMALLOC_SPLIT_THRESHOLD");
+    setThresholdFromEnv(SM_TRIM_THRESHOLD, "SMALLOC_TRIM_THRESHOLD");
+    setThresholdFromEnv(SM_TOP_PAD, "SMALLOC_TOP_PAD");
+    setThresholdFromEnv(SM_QUARANTINE_BYTES, "SMALLOC_QUARANTINE_BYTES");
+    setThresholdFromEnv(SM_PROFILE_RATE, "SMALLOC_PROFILE_RATE");
+    setThresholdFromEnv(SM_DEBUG_RATE, "SMALLOC_DEBUG_RATE");
+    const char* debug = getenv("SMALLOC_DEBUG");
+    if(debug && *debug && *debug != '0')
+        enableDebugMode();
+    reserveWilderness(HEAP_CHUNK_MIN);
+#if HEAP_LOCKING
+    pthread_atfork(lockHeap, unlockHeap, unlockHeap);
+#endif
+}
+
+// lockHeap still goes through heap_init_once, for allocations made by other
+// constructors that happen to run before this one
+__attribute__((constructor)) void initHeapEagerly()
+{
+    pthread_once(&heap_init_once, initHeap);
+    // the first backtrace() may load libgcc through the system malloc, get that
+    // out of the way here - initHeap itself may still run lazily from lockHeap
+    void* warm_up[1];
+    backtrace(warm_up, 1);
+}
+
+int setThreshold(int param, size_t value)
+{
+    switch(param)
+    {
+    case SM_MMAP_THRESHOLD:
+        if(value > MAX_MMAP_THRESHOLD)
+            return 0;
+        mmap_threshold = value;
+        mmap_threshold_fixed = true;
+        return 1;
+    case SM_SPLIT_THRESHOLD:
+        split_threshold = value;
+        return 1;
+    case SM_TRIM_THRESHOLD:
+        trim_threshold = value;
+        return 1;
+    case SM_TOP_PAD:
+        top_pad = value;
+        return 1;
+    case SM_QUARANTINE_BYTES:
+        quarantine_limit = value;
+        return 1;
+    case SM_PROFILE_RATE:
+        profile_rate = value;
+        return 1;
+    case SM_DEBUG_RATE:
+        if(value == 0)
+            return 0;
+        debug_rate = value;
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+// returns 1 on success and 0 on an unknown parameter or an out of range value, like mallopt()
+int smallopt(int param, size_t value)
+{
+    if(in_allocator)
+        return 0;
+    lockHeap();
+    int res = setThreshold(param, value);
+    unlockHeap();
+    return res;
+}
+
+bool isEmergencyBlock(void* p)
+{
+    return (size_t)p >= (size_t)emergency_pool && (size_t)p < (size_t)emergency_pool + EMERGENCY_POOL_SIZE;
+}
+
+size_t emergencyBlockSize(void* p)
+{
+    return *(size_t*)((size_t)p - EMERGENCY_ALIGN);
+}
+
+// the run of slot bits covering an emergency block of size bytes plus its header
+uint64_t emergencySlotRun(size_t size)
+{
+    size_t count = (EMERGENCY_ALIGN + size + EMERGENCY_SLOT_SIZE - 1) / EMERGENCY_SLOT_SIZE;
+    return count == EMERGENCY_SLOTS ? ~(uint64_t)0 : ((uint64_t)1 << count) - 1;
+}
+
+// lock-free first fit over the slot bitmap, safe to call from a signal handler
+void* emergencyAllocate(size_t size)
+{
+    if(size == 0 || size > EMERGENCY_POOL_SIZE - EMERGENCY_ALIGN)
+        return nullptr;
+    uint64_t run = emergencySlotRun(size);
+    uint64_t used = emergency_slots.load(std::memory_order_relaxed);
+    size_t first = 0;
+    while(first < EMERGENCY_SLOTS && (run << first) >> first == run)
+    {
+        if(used & (run << first))
+        {
+            first++;
+            continue;
+        }
+        if(!emergency_slots.compare_exchange_weak(used, used | (run << first)))
+        {
+            first = 0; // used was reloaded, rescan
+            continue;
+        }
+        char* block = emergency_pool + first * EMERGENCY_SLOT_SIZE;
+        *(size_t*)block = size;
+        return (void*)(block + EMERGENCY_ALIGN);
+    }
+    return nullptr;
+}
+
+void emergencyFree(void* p)
+{
+    size_t first = ((size_t)p - EMERGENCY_ALIGN - (size_t)emergency_pool) / EMERGENCY_SLOT_SIZE;
+    emergency_slots.fetch_and(~(emergencySlotRun(emergencyBlockSize(p)) << first));
+}
+
+// a nested sfree can't touch the lists, so the block is pushed here and freed by the next locked call
+void deferFree(void* p)
+{
+    MallocMetadata* MD = (MallocMetadata*)((size_t)p - _size_meta_data());
+    MallocMetadata* head = deferred_frees.load(std::memory_order_relaxed);
+    do {
+        MD->next_sorted_size = head;
+    } while(!deferred_frees.compare_exchange_weak(head, MD));
+}
+
+void drainDeferredFrees()
+{
+    MallocMetadata* it = deferred_frees.exchange(nullptr);
+    while(it)
+    {
+        MallocMetadata* next = it->next_sorted_size;
+        it->next_sorted_size = nullptr;
+        releaseBlock((void*)((size_t)it + _size_meta_data()));
+        it = next;
+    }
+}
+
+void lockHeap()
+{
+    // mark before blocking on the lock, so a signal can never find the lock held and the flag clear
+    in_allocator = true;
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+    pthread_once(&heap_init_once, initHeap);
+#if HEAP_LOCKING
+    pthread_mutex_lock(&heap_lock);
+#endif
+    drainDeferredFrees();
+}
+
+void unlockHeap()
+{
+#if HEAP_LOCKING
+    pthread_mutex_unlock(&heap_lock);
+#endif
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+    in_allocator = false;
+    current_operation = nullptr;
 }
 
 void* smalloc(size_t size)
+{
+    if(in_allocator)
+        return emergencyAllocate(size);
+    current_operation = "smalloc";
+    lockHeap();
+    void* ptr = allocateBlock(size);
+    if(ptr)
+        sampleAllocation(ptr, size);
+    unlockHeap();
+    return ptr;
+}
+
+void* allocateBlock(size_t size)
 {
     if(size <= (size_t)0 || size > MAX_SIZE) // size <= or only == 0 ?
         return nullptr;
+    if(debug_mode && guardNextAllocation())
+    {
+        void* ptr = allocateGuarded(size);
+        if(ptr)
+            return ptr;
+        // most likely out of mappings (vm.max_map_count), the heap still has room
+    }
     
+#if FIT_STRATEGY == NEXT_FIT
+    MallocMetadata* found = findNextFit(size);
+    if(found)
+    {
+        num_free_blocks--;
+        num_free_bytes -= found->size;
+        next_fit_rover = found->next_sorted_size;
+        removeFromFreeList(found);
+        found->is_free = false;
+        handleLargeBlock(found, size);
+        return (void*)((size_t)found+_size_meta_data());
+    }
+#else
     // search the metadata
     MallocMetadata* it = head_sorted_size;
     MallocMetadata* prev_in_sort_list = head_sorted_size;
@@ -102,6 +540,7 @@ void* smalloc(size_t size)
         }
         it = it->next_sorted_size;
     }
+#endif
 
     // if not found
 
@@ -110,26 +549,32 @@ void* smalloc(size_t size)
         return nullptr;
 
     exitOnCorruption(top_of_heap);
-    if(top_of_heap && top_of_heap->is_free)
+    if(top_of_heap && top_of_heap->is_free && canEnlargeTail(size - top_of_heap->size))
         return enlargeLastBlock(size, top_of_heap);
 
     void* start_of_new_data;
     MallocMetadata* new_data;
-    if(size >= LARGE_ALLOCATION)
+    if(size >= mmap_threshold)
     {
         void* start_of_new_data = mmap(NULL, size+_size_meta_data() , PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
         if(start_of_new_data == MAP_FAILED)
             return nullptr;
         new_data = (MallocMetadata*)start_of_new_data;
         new_data->cookie = cookie_val;
+        new_data->is_mmapped = true;
+        new_data->is_guarded = false;
+        new_data->is_sampled = false;
         //return (void*)((size_t)start_of_new_data+_size_meta_data());
     }
     else{
-        start_of_new_data = sbrk(_size_meta_data()+size);
+        start_of_new_data = carveWilderness(_size_meta_data()+size);
         if(start_of_new_data == ERROR)
             return nullptr;
         new_data = (MallocMetadata*)start_of_new_data;
         new_data->cookie = cookie_val;
+        new_data->is_mmapped = false;
+        new_data->is_guarded = false;
+        new_data->is_sampled = false;
         if(tail_address)
         {
             exitOnCorruption(tail_address);
@@ -151,12 +596,67 @@ void* smalloc(size_t size)
     return (void*)((size_t)new_data+_size_meta_data());
 }
 
+// make sure at least bytes are reserved past wilderness_start
+bool reserveWilderness(size_t bytes)
+{
+    if(wilderness_end - wilderness_start >= bytes)
+        return true;
+
+    size_t chunk = roundUp(bytes, HEAP_CHUNK_MIN);
+    if(chunk < heap_chunk)
+        chunk = heap_chunk;
+    void* more = sbrk((intptr_t)chunk);
+    if(more == ERROR)
+    {
+        more = mmap(NULL, chunk, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if(more == MAP_FAILED)
+            return false;
+    }
+    if((size_t)more != wilderness_end) // not contiguous, the rest of the old wilderness is abandoned
+        wilderness_start = (size_t)more;
+    wilderness_end = (size_t)more + chunk;
+    if(heap_chunk < HEAP_CHUNK_MAX)
+        heap_chunk *= 2;
+    return true;
+}
+
+// same contract as sbrk(bytes), but only goes to the system when the wilderness runs out
+void* carveWilderness(size_t bytes)
+{
+    if(!reserveWilderness(bytes))
+        return ERROR;
+    void* start = (void*)wilderness_start;
+    wilderness_start += bytes;
+    return start;
+}
+
+bool isAdjacent(MallocMetadata* md, MallocMetadata* next)
+{
+    return (size_t)md + _size_meta_data() + md->size == (size_t)next;
+}
+
+size_t shortfall(size_t size, size_t available)
+{
+    return size > available ? size - available : 0;
+}
+
+// true when the top block can grow by delta bytes in place. blocks in an
+// abandoned wilderness can't, so callers have to check before merging anything.
+bool canEnlargeTail(size_t delta)
+{
+    if(delta == 0)
+        return true;
+    if(!tail_address || !isAdjacent(tail_address, (MallocMetadata*)wilderness_start))
+        return false;
+    return reserveWilderness(delta) && isAdjacent(tail_address, (MallocMetadata*)wilderness_start);
+}
+
 void* enlargeLastBlock(size_t size, MallocMetadata* top_of_heap)
 {
     exitOnCorruption(top_of_heap);
     if(size <= top_of_heap->size)
         return nullptr;
-    void* addition = sbrk(size - top_of_heap->size);
+    void* addition = carveWilderness(size - top_of_heap->size);
     if(addition == ERROR)
         return nullptr;
     top_of_heap->is_free = false;
@@ -182,14 +682,48 @@ void* scalloc(size_t num, size_t size)
 }
 
 void sfree(void* p)
+{
+    if(!p)
+        return;
+    if(isEmergencyBlock(p))
+    {
+        emergencyFree(p);
+        return;
+    }
+    if(in_allocator)
+    {
+        deferFree(p);
+        return;
+    }
+    current_operation = "sfree";
+    lockHeap();
+    releaseBlock(p);
+    unlockHeap();
+}
+
+void releaseBlock(void* p)
 {
     if(!p)
         return;
     MallocMetadata* MD = (MallocMetadata*)((size_t)p - _size_meta_data());
     exitOnCorruption(MD);
+    GuardedBlock* guarded = checkGuarded(MD);
+    if(MD->is_sampled)
+        forgetSample(MD);
+    if(guarded)
+    {
+        releaseGuarded(MD, guarded);
+        return;
+    }
     MD->is_free = true;
-    if(MD->size >= LARGE_ALLOCATION)
+    if(MD->is_mmapped)
     {
+        if(!mmap_threshold_fixed && MD->size >= mmap_threshold && MD->size < MAX_MMAP_THRESHOLD)
+        {
+            mmap_threshold = MD->size + 1;
+            if(trim_threshold != NO_TRIM && trim_threshold < 2 * mmap_threshold)
+                trim_threshold = 2 * mmap_threshold;
+        }
         num_allocated_blocks--;
         num_allocated_bytes -= MD->size;
         munmap(MD, MD->size+_size_meta_data());
@@ -199,50 +733,606 @@ void sfree(void* p)
     num_free_bytes += MD->size;
     insertToFreeList(MD);
     mergeFreeBlocks(MD);
+    trimHeapTop();
     return;
 }
 
+// Give the top of the heap back to the system, like mallopt's M_TRIM_THRESHOLD
+// and M_TOP_PAD: a pad of top_pad bytes always stays reserved, and the break
+// only moves once the free space above that pad reaches trim_threshold, so an
+// alloc/free pair at the top of the heap doesn't cost two syscalls. Each trim
+// also halves heap_chunk, so a heap that shrinks stops growing in large steps.
+void trimHeapTop()
+{
+    MallocMetadata* top_of_heap = tail_address;
+    if(trim_threshold == NO_TRIM || !top_of_heap || !top_of_heap->is_free)
+        return;
+    exitOnCorruption(top_of_heap);
+    if(!isAdjacent(top_of_heap, (MallocMetadata*)wilderness_start))
+        return;
+    if((size_t)sbrk(0) != wilderness_end) // an mmap reservation, or someone else moved the break
+        return;
+    size_t top_free = wilderness_end - (size_t)top_of_heap; // the top block and the wilderness
+    if(top_free < top_pad || top_free - top_pad < trim_threshold)
+        return;
+
+    removeFromFreeList(top_of_heap);
+    tail_address = top_of_heap->prev_by_address;
+    if(tail_address)
+        tail_address->next_by_address = nullptr;
+    num_free_blocks--;
+    num_free_bytes -= top_of_heap->size;
+    num_allocated_blocks--;
+    num_allocated_bytes -= top_of_heap->size;
+    wilderness_start = (size_t)top_of_heap;
+
+    size_t release = top_free - top_pad;
+    sbrk(-(intptr_t)release);
+    wilderness_end -= release;
+    if(heap_chunk > HEAP_CHUNK_MIN)
+        heap_chunk /= 2;
+}
+
+size_t roundUp(size_t value, size_t alignment)
+{
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+bool guardNextAllocation()
+{
+    if(++allocations_since_guarded < debug_rate)
+        return false;
+    allocations_since_guarded = 0;
+    return true;
+}
+
+size_t guardedDataLength(size_t size)
+{
+    return roundUp(_size_meta_data() + roundUp(size, GUARDED_ALIGN), page_size);
+}
+
+size_t guardedSlot(size_t user)
+{
+    return (user >> 4) * 0x9e3779b97f4a7c15ULL % GUARDED_SLOTS;
+}
+
+// nullptr when the table is full, the caller falls back to the heap
+GuardedBlock* insertGuarded(size_t user)
+{
+    size_t slot = guardedSlot(user);
+    for(size_t probe = 0; probe < GUARDED_SLOTS; probe++, slot = (slot + 1) % GUARDED_SLOTS)
+    {
+        if(guarded_blocks[slot].user == 0)
+        {
+            guarded_blocks[slot].user = user;
+            return &guarded_blocks[slot];
+        }
+    }
+    return nullptr;
+}
+
+GuardedBlock* findGuarded(size_t user)
+{
+    for(size_t slot = guardedSlot(user); guarded_blocks[slot].user != 0; slot = (slot + 1) % GUARDED_SLOTS)
+    {
+        if(guarded_blocks[slot].user == user)
+            return &guarded_blocks[slot];
+    }
+    return nullptr;
+}
+
+// backward shift deletion, as in removeLiveSample()
+void removeGuarded(GuardedBlock* entry)
+{
+    size_t hole = (size_t)(entry - guarded_blocks);
+    for(size_t next = (hole + 1) % GUARDED_SLOTS; guarded_blocks[next].user != 0; next = (next + 1) % GUARDED_SLOTS)
+    {
+        size_t home = guardedSlot(guarded_blocks[next].user);
+        if((next - home) % GUARDED_SLOTS >= (next - hole) % GUARDED_SLOTS)
+        {
+            guarded_blocks[hole] = guarded_blocks[next];
+            hole = next;
+        }
+    }
+    guarded_blocks[hole].user = 0;
+}
+
+// The table entry of a guarded block, or nullptr for a heap block. The header
+// has to agree with the table - guarded blocks keep their links null - otherwise
+// it was overwritten, typically by an underflow of the block itself, and is
+// reported before anything trusts it.
+GuardedBlock* checkGuarded(MallocMetadata* md)
+{
+    if(!debug_mode)
+        return nullptr;
+    GuardedBlock* entry = findGuarded((size_t)md + _size_meta_data());
+    if(!entry && !md->is_guarded)
+        return nullptr;
+    if(!entry || !md->is_guarded || !md->is_mmapped || md->is_free || md->size != entry->size
+        || md->next_sorted_size || md->prev_by_address || md->next_by_address)
+    {
+        reportCorruption(md);
+        exit(0xdeadbeef);
+    }
+    return entry;
+}
+
+// the block is placed as close to the guard page as GUARDED_ALIGN allows, the
+// few slack bytes in between are filled with GUARD_FILL and checked on sfree
+void* allocateGuarded(size_t size)
+{
+    size_t data_len = guardedDataLength(size);
+    void* base = mmap(NULL, data_len + page_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(base == MAP_FAILED)
+        return nullptr;
+    size_t user = (size_t)base + data_len - roundUp(size, GUARDED_ALIGN);
+    GuardedBlock* entry = insertGuarded(user);
+    if(!entry || mprotect((void*)((size_t)base + data_len), page_size, PROT_NONE) != 0)
+    {
+        if(entry)
+            removeGuarded(entry);
+        munmap(base, data_len + page_size);
+        return nullptr;
+    }
+    entry->size = size;
+
+    memset((void*)(user + size), GUARD_FILL, roundUp(size, GUARDED_ALIGN) - size);
+    MallocMetadata* new_data = (MallocMetadata*)(user - _size_meta_data());
+    new_data->cookie = cookie_val;
+    new_data->size = size;
+    new_data->is_free = false;
+    new_data->is_mmapped = true;
+    new_data->is_guarded = true;
+    new_data->is_sampled = false;
+    new_data->next_sorted_size = nullptr;
+    new_data->prev_by_address = nullptr;
+    new_data->next_by_address = nullptr;
+    num_allocated_blocks++;
+    num_allocated_bytes += size;
+    return (void*)user;
+}
+
+// guarded has already been checked against md by checkGuarded()
+void releaseGuarded(MallocMetadata* md, GuardedBlock* guarded)
+{
+    size_t user = (size_t)md + _size_meta_data();
+    for(size_t i = md->size; i < roundUp(md->size, GUARDED_ALIGN); i++)
+    {
+        if(*(unsigned char*)(user + i) != GUARD_FILL)
+        {
+            reportCorruption(md);
+            exit(0xdeadbeef);
+        }
+    }
+
+    removeGuarded(guarded);
+    num_allocated_blocks--;
+    num_allocated_bytes -= md->size;
+
+    QuarantineEntry entry;
+    entry.base = (size_t)md / page_size * page_size;
+    entry.data_len = guardedDataLength(md->size);
+    entry.user = user;
+    entry.size = md->size;
+    mprotect((void*)entry.base, entry.data_len, PROT_NONE);
+
+    while(quarantine_count == QUARANTINE_SLOTS || (quarantine_count && quarantine_bytes + entry.data_len > quarantine_limit))
+    {
+        QuarantineEntry& oldest = quarantine[quarantine_first];
+        munmap((void*)oldest.base, oldest.data_len + page_size);
+        quarantine_bytes -= oldest.data_len;
+        quarantine_first = (quarantine_first + 1) % QUARANTINE_SLOTS;
+        quarantine_count--;
+    }
+    quarantine[(quarantine_first + quarantine_count) % QUARANTINE_SLOTS] = entry;
+    quarantine_count++;
+    quarantine_bytes += entry.data_len;
+}
+
+// reports are written with write() only, they run from a SIGSEGV handler and must not allocate
+void writeString(int fd, const char* str)
+{
+    ssize_t res = write(fd, str, strlen(str));
+    (void)res;
+}
+
+void writeNumber(int fd, size_t value, size_t base)
+{
+    char buf[32];
+    size_t pos = sizeof(buf);
+    buf[--pos] = '\0';
+    do {
+        buf[--pos] = "0123456789abcdef"[value % base];
+        value /= base;
+    } while(value);
+    if(base == 16)
+    {
+        buf[--pos] = 'x';
+        buf[--pos] = '0';
+    }
+    writeString(fd, buf + pos);
+}
+
+void writeOperation()
+{
+    writeString(STDERR_FILENO, current_operation ? " during " : " in the application");
+    if(current_operation)
+        writeString(STDERR_FILENO, current_operation);
+    writeString(STDERR_FILENO, "\n");
+}
+
+void reportCorruption(MallocMetadata* md)
+{
+    size_t user = (size_t)md + _size_meta_data();
+    GuardedBlock* guarded = findGuarded(user); // the table still has the size a smashed header lost
+    writeString(STDERR_FILENO, "smalloc: heap corruption at block ");
+    writeNumber(STDERR_FILENO, user, 16);
+    writeString(STDERR_FILENO, " of ");
+    writeNumber(STDERR_FILENO, guarded ? guarded->size : md->size, 10);
+    writeString(STDERR_FILENO, " bytes");
+    writeOperation();
+}
+
+void reportFault(const char* kind, const char* access, size_t addr, size_t user, size_t size)
+{
+    writeString(STDERR_FILENO, "smalloc: ");
+    writeString(STDERR_FILENO, kind);
+    writeString(STDERR_FILENO, ": ");
+    writeString(STDERR_FILENO, access);
+    writeString(STDERR_FILENO, " at ");
+    writeNumber(STDERR_FILENO, addr, 16);
+    writeString(STDERR_FILENO, ", ");
+    writeNumber(STDERR_FILENO, addr < user ? user - addr : addr - user, 10);
+    writeString(STDERR_FILENO, addr < user ? " bytes before a " : " bytes into a ");
+    writeNumber(STDERR_FILENO, size, 10);
+    writeString(STDERR_FILENO, "-byte block at ");
+    writeNumber(STDERR_FILENO, user, 16);
+    writeOperation();
+}
+
+void guardFaultHandler(int sig, siginfo_t* info, void* context)
+{
+    size_t addr = (size_t)info->si_addr;
+    const char* access = "access";
+#if defined(__x86_64__)
+    access = (((ucontext_t*)context)->uc_mcontext.gregs[REG_ERR] & 2) ? "write" : "read";
+#else
+    (void)context;
+#endif
+
+    for(size_t i = 0; i < GUARDED_SLOTS; i++)
+    {
+        GuardedBlock& entry = guarded_blocks[i];
+        if(entry.user == 0)
+            continue;
+        size_t guard = (entry.user - _size_meta_data()) / page_size * page_size + guardedDataLength(entry.size);
+        if(addr >= guard && addr < guard + page_size)
+        {
+            reportFault("heap-buffer-overflow", access, addr, entry.user, entry.size);
+            break;
+        }
+    }
+    for(size_t i = 0; i < quarantine_count; i++)
+    {
+        QuarantineEntry& entry = quarantine[(quarantine_first + i) % QUARANTINE_SLOTS];
+        if(addr >= entry.base && addr < entry.base + entry.data_len)
+        {
+            // sfree faulting on a block's own header means it was already freed
+            bool double_free = addr < entry.user && current_operation && strcmp(current_operation, "sfree") == 0;
+            reportFault(double_free ? "double-free" : "use-after-free", access, addr, entry.user, entry.size);
+            break;
+        }
+    }
+
+    // not ours, or already reported - hand the fault to the application's handler
+    struct sigaction* previous = sig == SIGBUS ? &previous_bus_action : &previous_segv_action;
+    if(previous->sa_flags & SA_SIGINFO)
+        previous->sa_sigaction(sig, info, context);
+    else if(previous->sa_handler != SIG_DFL && previous->sa_handler != SIG_IGN)
+        previous->sa_handler(sig);
+    else // put the default action back and let the access fault again
+        sigaction(sig, previous, nullptr);
+}
+
+void enableDebugMode()
+{
+    void* table = mmap(NULL, GUARDED_SLOTS * sizeof(GuardedBlock), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(table == MAP_FAILED)
+        return; // no table to check headers against, stay out of debug mode
+    guarded_blocks = (GuardedBlock*)table;
+    debug_mode = true;
+    page_size = (size_t)sysconf(_SC_PAGESIZE);
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = guardFaultHandler;
+    action.sa_flags = SA_SIGINFO;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGSEGV, &action, &previous_segv_action);
+    sigaction(SIGBUS, &action, &previous_bus_action);
+}
+
+size_t nextSampleInterval()
+{
+    if(sample_rng == 0)
+        sample_rng = ((uint64_t)(size_t)&sample_rng * 0x9e3779b97f4a7c15ULL) | 1;
+    sample_rng ^= sample_rng << 13; // xorshift64
+    sample_rng ^= sample_rng >> 7;
+    sample_rng ^= sample_rng << 17;
+    double uniform = ((sample_rng >> 11) + 1) * (1.0 / 9007199254740992.0); // (0, 1]
+    return (size_t)(-std::log(uniform) * (double)profile_rate) + 1;
+}
+
+void* mapProfileTable(size_t bytes)
+{
+    void* table = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return table == MAP_FAILED ? nullptr : table;
+}
+
+ProfileBucket* findBucket(void** stack, size_t depth)
+{
+    size_t hash = depth;
+    for(size_t i = 0; i < depth; i++)
+        hash = (hash ^ (size_t)stack[i]) * 0x100000001b3ULL;
+
+    for(size_t probe = 0; probe < PROFILE_BUCKETS; probe++)
+    {
+        ProfileBucket* bucket = &profile_buckets[(hash + probe) % PROFILE_BUCKETS];
+        if(bucket->depth == 0)
+        {
+            bucket->depth = depth;
+            memcpy(bucket->stack, stack, depth * sizeof(void*));
+            return bucket;
+        }
+        if(bucket->depth == depth && memcmp(bucket->stack, stack, depth * sizeof(void*)) == 0)
+            return bucket;
+    }
+    return nullptr;
+}
+
+size_t liveSlot(size_t user)
+{
+    return (user >> 4) * 0x9e3779b97f4a7c15ULL % PROFILE_LIVE_SLOTS;
+}
+
+// called for every allocation, so only the countdown is on the fast path
+void sampleAllocation(void* p, size_t size)
+{
+    if(profile_rate == 0)
+        return;
+    if(bytes_until_sample > size)
+    {
+        bytes_until_sample -= size;
+        return;
+    }
+    bool first = sample_rng == 0;
+    bytes_until_sample = nextSampleInterval();
+    if(!first)
+        recordSample(p, size);
+}
+
+__attribute__((noinline)) void recordSample(void* p, size_t size)
+{
+    if(!profile_buckets)
+    {
+        profile_buckets = (ProfileBucket*)mapProfileTable(PROFILE_BUCKETS * sizeof(ProfileBucket));
+        live_samples = (LiveSample*)mapProfileTable(PROFILE_LIVE_SLOTS * sizeof(LiveSample));
+        if(!profile_buckets || !live_samples)
+        {
+            profile_rate = 0;
+            return;
+        }
+    }
+
+    void* stack[PROFILE_MAX_DEPTH + 2];
+    int depth = backtrace(stack, PROFILE_MAX_DEPTH + 2);
+    const int skip = 2; // recordSample and the allocator frame that called it
+    ProfileBucket* bucket = depth > skip ? findBucket(stack + skip, (size_t)(depth - skip)) : nullptr;
+    if(!bucket)
+    {
+        profile_dropped++;
+        return;
+    }
+    bucket->alloc_count++;
+    bucket->alloc_bytes += size;
+
+    size_t slot = liveSlot((size_t)p);
+    for(size_t probe = 0; probe < PROFILE_LIVE_SLOTS; probe++, slot = (slot + 1) % PROFILE_LIVE_SLOTS)
+    {
+        if(live_samples[slot].user == 0)
+        {
+            live_samples[slot].user = (size_t)p;
+            live_samples[slot].size = size;
+            live_samples[slot].bucket = bucket;
+            bucket->live_count++;
+            bucket->live_bytes += size;
+            ((MallocMetadata*)((size_t)p - _size_meta_data()))->is_sampled = true;
+            return;
+        }
+    }
+    profile_dropped++;
+}
+
+void forgetSample(MallocMetadata* md)
+{
+    md->is_sampled = false;
+    removeLiveSample((size_t)md + _size_meta_data());
+}
+
+void removeLiveSample(size_t user)
+{
+    size_t slot = liveSlot(user);
+    while(live_samples[slot].user != user)
+    {
+        if(live_samples[slot].user == 0)
+            return;
+        slot = (slot + 1) % PROFILE_LIVE_SLOTS;
+    }
+    live_samples[slot].bucket->live_count--;
+    live_samples[slot].bucket->live_bytes -= live_samples[slot].size;
+
+    // backward shift deletion, so lookups never need tombstones
+    size_t hole = slot;
+    for(size_t next = (hole + 1) % PROFILE_LIVE_SLOTS; live_samples[next].user != 0; next = (next + 1) % PROFILE_LIVE_SLOTS)
+    {
+        size_t home = liveSlot(live_samples[next].user);
+        if((next - home) % PROFILE_LIVE_SLOTS >= (next - hole) % PROFILE_LIVE_SLOTS)
+        {
+            live_samples[hole] = live_samples[next];
+            hole = next;
+        }
+    }
+    live_samples[hole].user = 0;
+}
+
+void writeProfileCounts(int fd, size_t live_count, size_t live_bytes, size_t alloc_count, size_t alloc_bytes)
+{
+    writeNumber(fd, live_count, 10);
+    writeString(fd, ": ");
+    writeNumber(fd, live_bytes, 10);
+    writeString(fd, " [");
+    writeNumber(fd, alloc_count, 10);
+    writeString(fd, ": ");
+    writeNumber(fd, alloc_bytes, 10);
+    writeString(fd, "] @");
+}
+
+// Writes the sampled live heap and cumulative allocations in the legacy pprof
+// heap profile format (heap_v2), followed by the process mappings pprof needs
+// to symbolize. Returns 0, or -1 when the profiler is off.
+int sheap_profile(int fd)
+{
+    if(in_allocator)
+        return -1;
+    lockHeap();
+    if(profile_rate == 0 && !profile_buckets)
+    {
+        unlockHeap();
+        return -1;
+    }
+
+    size_t totals[4] = {0, 0, 0, 0};
+    for(size_t i = 0; profile_buckets && i < PROFILE_BUCKETS; i++)
+    {
+        totals[0] += profile_buckets[i].live_count;
+        totals[1] += profile_buckets[i].live_bytes;
+        totals[2] += profile_buckets[i].alloc_count;
+        totals[3] += profile_buckets[i].alloc_bytes;
+    }
+    writeString(fd, "heap profile: ");
+    writeProfileCounts(fd, totals[0], totals[1], totals[2], totals[3]);
+    writeString(fd, " heap_v2/");
+    writeNumber(fd, profile_rate, 10);
+    writeString(fd, "\n");
+
+    for(size_t i = 0; profile_buckets && i < PROFILE_BUCKETS; i++)
+    {
+        ProfileBucket& bucket = profile_buckets[i];
+        if(bucket.depth == 0)
+            continue;
+        writeProfileCounts(fd, bucket.live_count, bucket.live_bytes, bucket.alloc_count, bucket.alloc_bytes);
+        for(size_t frame = 0; frame < bucket.depth; frame++)
+        {
+            writeString(fd, " ");
+            writeNumber(fd, (size_t)bucket.stack[frame], 16);
+        }
+        writeString(fd, "\n");
+    }
+    writeString(fd, "# dropped samples: ");
+    writeNumber(fd, profile_dropped, 10);
+    writeString(fd, "\n");
+    unlockHeap();
+
+    writeString(fd, "\nMAPPED_LIBRARIES:\n");
+    int maps = open("/proc/self/maps", O_RDONLY);
+    if(maps >= 0)
+    {
+        char buf[4096];
+        ssize_t len;
+        while((len = read(maps, buf, sizeof(buf))) > 0)
+        {
+            ssize_t res = write(fd, buf, (size_t)len);
+            (void)res;
+        }
+        close(maps);
+    }
+    return 0;
+}
+
 void* srealloc(void* oldp, size_t size)
 {
     if(size == 0 || size > MAX_SIZE)
         return nullptr;
 
+    if(isEmergencyBlock(oldp) || (oldp && in_allocator))
+    {
+        size_t old_size = isEmergencyBlock(oldp) ? emergencyBlockSize(oldp)
+                        : ((MallocMetadata*)((size_t)oldp - _size_meta_data()))->size;
+        void* newp = smalloc(size);
+        if(!newp)
+            return nullptr;
+        memmove(newp, oldp, old_size < size ? old_size : size);
+        sfree(oldp);
+        return newp;
+    }
+
+    if(in_allocator)
+        return emergencyAllocate(size);
+    current_operation = "srealloc";
+    lockHeap();
+    // profiled as a free of the old block and an allocation of the new one. the
+    // flag is cleared so a move doesn't drop the sample through releaseBlock, and
+    // the sample itself goes only once the old block is really gone
+    MallocMetadata* old_md = oldp ? (MallocMetadata*)((size_t)oldp - _size_meta_data()) : nullptr;
+    bool old_sampled = old_md && old_md->is_sampled;
+    if(old_sampled)
+        old_md->is_sampled = false;
+    void* ptr = reallocateBlock(oldp, size);
+    if(ptr)
+    {
+        if(old_sampled)
+            removeLiveSample((size_t)oldp);
+        sampleAllocation(ptr, size);
+    }
+    else if(old_sampled)
+        old_md->is_sampled = true;
+    unlockHeap();
+    return ptr;
+}
+
+void* reallocateBlock(void* oldp, size_t size)
+{
     if(!oldp)
     {
-        void* ptr = smalloc(size);
+        void* ptr = allocateBlock(size);
         return ptr;
     }
 
     MallocMetadata* MD = (MallocMetadata*)((size_t)oldp - _size_meta_data());
     exitOnCorruption(MD);
 
-    if(MD->size >= LARGE_ALLOCATION) // case mmap
+    if(checkGuarded(MD)) // debug mode always moves, so stale pointers land in the quarantine
     {
-        if(size > LARGE_ALLOCATION)
-        {
-            if(size <= MD->size)
-                return oldp;
-            
-            num_allocated_bytes -= (MD->size + _size_meta_data());
-            munmap(MD, MD->size+_size_meta_data());
-            void* start_of_new_data = mmap(NULL, size+_size_meta_data() , PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-            if(start_of_new_data == MAP_FAILED)
-                return nullptr;
-            MallocMetadata* new_data = (MallocMetadata*)start_of_new_data;
-            new_data->cookie = cookie_val;
-            new_data->size = size;
-            new_data->next_sorted_size = nullptr;
-            num_allocated_bytes += (new_data->size + _size_meta_data());
-            new_data->is_free = false;
-            return (void*)((size_t)new_data + _size_meta_data());
-        }
-        else
-        {
-            // exitOnCorruption(MD);
-            // num_allocated_bytes -= (MD->size + _size_meta_data());
-            // munmap(MD, MD->size+_size_meta_data());
+        void* newp = allocateBlock(size);
+        if(!newp)
+            return nullptr;
+        memmove(newp, oldp, MD->size < size ? MD->size : size);
+        releaseBlock(oldp);
+        return newp;
+    }
+
+    if(MD->is_mmapped) // case mmap
+    {
+        if(size <= MD->size)
             return oldp;
-        }
+
+        // the threshold may have moved since MD was mapped, so let allocateBlock pick mmap or heap
+        void* newp = allocateBlock(size);
+        if(!newp)
+            return nullptr;
+        memmove(newp, oldp, MD->size);
+        releaseBlock(oldp);
+        return newp;
     }
 
     if(size <= MD->size) { // case a
@@ -253,9 +1343,14 @@ void* srealloc(void* oldp, size_t size)
     exitOnCorruption(MD->prev_by_address);
     exitOnCorruption(MD->next_by_address);
 
+    MallocMetadata* prev = MD->prev_by_address;
+    MallocMetadata* next = MD->next_by_address;
+    bool prev_mergeable = prev && prev->is_free && isAdjacent(prev, MD);
+    bool next_mergeable = next && next->is_free && isAdjacent(MD, next);
+
     if(tail_address == MD)
     {
-        if((MD->prev_by_address) && (MD->prev_by_address->is_free)) // case b wilderness
+        if(prev_mergeable && canEnlargeTail(shortfall(size, prev->size + MD->size + _size_meta_data()))) // case b wilderness
         {
             MallocMetadata* src = MD;
             MallocMetadata* dst = MD->prev_by_address;
@@ -286,7 +1381,7 @@ void* srealloc(void* oldp, size_t size)
             handleLargeBlock(dst, size);
             return (void*)((size_t)dst + _size_meta_data());
         }
-        else // case c
+        else if(canEnlargeTail(shortfall(size, MD->size))) // case c
         {
             MallocMetadata* top_of_heap = tail_address;
             if(top_of_heap == ERROR)
@@ -305,7 +1400,7 @@ void* srealloc(void* oldp, size_t size)
     }
     // not tail address
 
-    if((MD->prev_by_address) && (MD->prev_by_address->is_free)) // case b && !tail_address
+    if(prev_mergeable) // case b && !tail_address
     {
         if(size <= MD->size + MD->prev_by_address->size + _size_meta_data())
         {
@@ -325,7 +1420,7 @@ void* srealloc(void* oldp, size_t size)
         }
     }
     
-    if((MD->next_by_address) && (MD->next_by_address->is_free)) //case d
+    if(next_mergeable) //case d
     {
         if(size <= MD->size + MD->next_by_address->size + _size_meta_data())
         {
@@ -342,8 +1437,7 @@ void* srealloc(void* oldp, size_t size)
         }
     }
 
-    if(MD->next_by_address && (MD->next_by_address->is_free) &&
-      (MD->prev_by_address) && (MD->prev_by_address->is_free)) //case e
+    if(next_mergeable && prev_mergeable) //case e
     {
         if(size <= MD->size + MD->next_by_address->size + MD->prev_by_address->size + 2*_size_meta_data())
         {
@@ -363,9 +1457,9 @@ void* srealloc(void* oldp, size_t size)
         }
     }
 
-    if(MD->next_by_address && MD->next_by_address->is_free) // case f
+    if(next_mergeable && next == tail_address) // case f, only the top block can grow
     {
-        if(MD->prev_by_address && MD->prev_by_address->is_free) // case fi as in case e  + enlargment
+        if(prev_mergeable && canEnlargeTail(shortfall(size, prev->size + MD->size + next->size + 2*_size_meta_data()))) // case fi as in case e  + enlargment
         {
             MallocMetadata* src = MD;
             MallocMetadata* dst = MD->prev_by_address;
@@ -390,7 +1484,7 @@ void* srealloc(void* oldp, size_t size)
             handleLargeBlock(dst, size);
             return (void*)((size_t)dst + _size_meta_data());
         }
-        else // case fii as in case d + enlargment
+        else if(canEnlargeTail(shortfall(size, MD->size + next->size + _size_meta_data()))) // case fii as in case d + enlargment
         {
             num_free_bytes += MD->size;
             insertToFreeList(MD);
@@ -410,12 +1504,12 @@ void* srealloc(void* oldp, size_t size)
         }
     }
 
-    void* newp = smalloc(size); // cases g + h
+    void* newp = allocateBlock(size); // cases g + h
     if(!newp)
         return nullptr;
     
-    memmove(newp, oldp, size);
-    sfree(oldp);
+    memmove(newp, oldp, MD->size);
+    releaseBlock(oldp);
     return newp;
 }
 
@@ -458,12 +1552,15 @@ void handleLargeBlock(MallocMetadata* md, size_t size)
         return;
 
     size_t remainder = md->size - size - _size_meta_data();
-    if(remainder < LARGE_BLOCK)
+    if(remainder < split_threshold)
         return;
 
     md->size = size;
     MallocMetadata* new_md = (MallocMetadata*)((size_t)md + md->size + _size_meta_data());
     new_md->cookie = cookie_val;
+    new_md->is_mmapped = false;
+    new_md->is_guarded = false;
+    new_md->is_sampled = false;
     new_md->size = remainder;
     //num_free_bytes -= _size_meta_data();
     num_free_bytes += remainder;
@@ -497,8 +1594,8 @@ void insertToFreeList(MallocMetadata* to_insert)
 
     if(curr->next_sorted_size == nullptr)
     {
-        if(curr->size <= to_insert->size){
-            if(curr->size == to_insert->size)
+        if(freeListKey(curr) <= freeListKey(to_insert)){
+            if(freeListKey(curr) == freeListKey(to_insert))
             {
                 if((size_t)curr > (size_t)to_insert)
                 {
@@ -514,7 +1611,7 @@ void insertToFreeList(MallocMetadata* to_insert)
         }
     }
 
-    if(curr->size > to_insert->size){
+    if(freeListKey(curr) > freeListKey(to_insert)){
         MallocMetadata *tmp = curr; //=head
         head_sorted_size = to_insert;
         to_insert->next_sorted_size = tmp;
@@ -522,10 +1619,10 @@ void insertToFreeList(MallocMetadata* to_insert)
     }
 
     exitOnCorruption(curr->next_sorted_size);
-    while(curr->next_sorted_size && (curr->next_sorted_size->size <= to_insert->size))
+    while(curr->next_sorted_size && (freeListKey(curr->next_sorted_size) <= freeListKey(to_insert)))
     {
         exitOnCorruption(curr->next_sorted_size);
-        while(curr->next_sorted_size && curr->next_sorted_size->size == to_insert->size)
+        while(curr->next_sorted_size && freeListKey(curr->next_sorted_size) == freeListKey(to_insert))
         {
             exitOnCorruption(curr->next_sorted_size);
             if((size_t)(curr->next_sorted_size) > (size_t)to_insert)
@@ -556,7 +1653,7 @@ void mergeNextFreeBlock(MallocMetadata* md)
     if(!md->next_by_address)
         return;
     exitOnCorruption(md->next_by_address);
-    if(md->next_by_address->is_free){
+    if(md->next_by_address->is_free && isAdjacent(md, md->next_by_address)){
         removeFromFreeList(md->next_by_address);
         removeFromFreeList(md);
         if(md->next_by_address == tail_address)
@@ -585,9 +1682,30 @@ void mergeFreeBlocks(MallocMetadata* md){
     return;
 }
 
+// search from the rover to the end of the address ordered list, then wrap around
+MallocMetadata* findNextFit(size_t size)
+{
+    MallocMetadata* start = next_fit_rover ? next_fit_rover : head_sorted_size;
+    for(MallocMetadata* it = start; it; it = it->next_sorted_size)
+    {
+        exitOnCorruption(it);
+        if(it->size >= size)
+            return it;
+    }
+    for(MallocMetadata* it = head_sorted_size; it != start; it = it->next_sorted_size)
+    {
+        exitOnCorruption(it);
+        if(it->size >= size)
+            return it;
+    }
+    return nullptr;
+}
+
 void removeFromFreeList(MallocMetadata* to_remove)
 {
     exitOnCorruption(to_remove);
+    if(to_remove == next_fit_rover)
+        next_fit_rover = to_remove->next_sorted_size;
     MallocMetadata* it = head_sorted_size;
     exitOnCorruption(it);
     if(it == nullptr)
@@ -0,0 +1,78 @@
+// Large-block churn benchmark for malloc_3.cpp.
+//
+// Allocates a block of about 200 KB (above the default mmap threshold), a small
+// block that stays live, then frees the large one, 100k times over. mmap,
+// munmap and sbrk calls are counted through the linker's --wrap. With the
+// adaptive mmap threshold only the first few large blocks are mapped; pin the
+// threshold to compare against one mapping per iteration:
+// SMALLOC_MMAP_THRESHOLD=131072 ./malloc_3_churn_bench
+//
+// g++ -O2 -o malloc_3_churn_bench malloc_3_churn_bench.cpp malloc_3.cpp -lpthread -Wl,--wrap=mmap,--wrap=munmap,--wrap=sbrk
+
+#include "stdlib.h"
+#include "unistd.h"
+#include <cstdio>
+#include <cstdint>
+#include <chrono>
+#include <sys/mman.h>
+
+#define NUM_ITERATIONS 100000
+#define LARGE_BLOCK_SIZE ((size_t)(200*1024))
+#define SMALL_BLOCK_SIZE 64
+
+void* smalloc(size_t size);
+void sfree(void* p);
+
+long mmap_calls = 0;
+long munmap_calls = 0;
+long sbrk_calls = 0;
+
+extern "C" void* __real_mmap(void* addr, size_t length, int prot, int flags, int fd, off_t offset);
+extern "C" int __real_munmap(void* addr, size_t length);
+extern "C" void* __real_sbrk(intptr_t increment);
+
+extern "C" void* __wrap_mmap(void* addr, size_t length, int prot, int flags, int fd, off_t offset)
+{
+    mmap_calls++;
+    return __real_mmap(addr, length, prot, flags, fd, offset);
+}
+
+extern "C" int __wrap_munmap(void* addr, size_t length)
+{
+    munmap_calls++;
+    return __real_munmap(addr, length);
+}
+
+extern "C" void* __wrap_sbrk(intptr_t increment)
+{
+    if(increment != 0) // sbrk(0) only reads the break
+        sbrk_calls++;
+    return __real_sbrk(increment);
+}
+
+int main()
+{
+    static void* small_blocks[NUM_ITERATIONS];
+
+    auto start = std::chrono::steady_clock::now();
+    for(int i = 0; i < NUM_ITERATIONS; i++)
+    {
+        size_t size = LARGE_BLOCK_SIZE + (size_t)(i % 4) * 1024;
+        char* large = (char*)smalloc(size);
+        small_blocks[i] = smalloc(SMALL_BLOCK_SIZE);
+        if(!large || !small_blocks[i])
+        {
+            printf("smalloc failed at iteration %d\n", i);
+            return 1;
+        }
+        large[0] = 1;
+        large[size - 1] = 1;
+        sfree(large);
+    }
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    printf("%8.1f ms  mmap %6ld  munmap %6ld  sbrk %6ld\n", ms, mmap_calls, munmap_calls, sbrk_calls);
+
+    for(int i = 0; i < NUM_ITERATIONS; i++)
+        sfree(small_blocks[i]);
+    return 0;
+}
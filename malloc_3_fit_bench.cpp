@@ -0,0 +1,47 @@
+// Allocation benchmark for one build configuration of malloc_3.cpp.
+//
+// Keeps 512 slots of random 1-2048 byte blocks and replaces a random slot on
+// every step, then prints the run time and how much of the heap ended up free
+// (fragmentation). malloc_3_sweep.sh builds and runs it for each policy.
+//
+// g++ -O2 -DFIT_STRATEGY=NEXT_FIT -o malloc_3_fit_bench malloc_3_fit_bench.cpp malloc_3.cpp -lpthread
+
+#include "stdlib.h"
+#include <cstdio>
+#include <cstring>
+#include <chrono>
+
+#define NUM_SLOTS 512
+#define NUM_STEPS 400000
+#define MAX_BLOCK 2048
+
+void* smalloc(size_t size);
+void sfree(void* p);
+size_t _num_free_bytes();
+size_t _num_allocated_bytes();
+
+int main()
+{
+    void* slots[NUM_SLOTS] = {};
+    srand(1);
+
+    auto start = std::chrono::steady_clock::now();
+    for(int i = 0; i < NUM_STEPS; i++)
+    {
+        int slot = rand() % NUM_SLOTS;
+        sfree(slots[slot]);
+        size_t size = (size_t)(rand() % MAX_BLOCK + 1);
+        slots[slot] = smalloc(size);
+        if(!slots[slot])
+        {
+            printf("smalloc(%zu) failed\n", size);
+            return 1;
+        }
+        memset(slots[slot], 1, size);
+    }
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+    printf("%8.1f ms  heap %8zu bytes  free %8zu bytes (%4.1f%%)\n", ms, _num_allocated_bytes(), _num_free_bytes(),
+           100.0 * (double)_num_free_bytes() / (double)_num_allocated_bytes());
+    return 0;
+}
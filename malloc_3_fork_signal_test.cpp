@@ -0,0 +1,120 @@
+// Fork and signal stress test for malloc_3.cpp.
+//
+// Worker threads hammer smalloc/srealloc/sfree while a fast SIGALRM timer runs a
+// handler that allocates too, and the main thread keeps forking. Every child must
+// still be able to smalloc/sfree (a child inheriting a held heap lock would hang
+// and be killed by its watchdog), and no nested allocation may fail or come back
+// corrupted.
+//
+// g++ -O1 -o malloc_3_fork_signal_test malloc_3_fork_signal_test.cpp malloc_3.cpp -lpthread
+// ./malloc_3_fork_signal_test
+
+#include "stdlib.h"
+#include "unistd.h"
+#include <cstdio>
+#include <cstring>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#define NUM_THREADS 3
+#define NUM_ITERATIONS 200000
+#define NUM_FORKS 200
+#define TIMER_USEC 50
+#define CHILD_TIMEOUT_SEC 5
+
+void* smalloc(size_t size);
+void sfree(void* p);
+void* srealloc(void* oldp, size_t size);
+
+volatile sig_atomic_t handler_calls = 0;
+volatile sig_atomic_t handler_failures = 0;
+volatile sig_atomic_t worker_failures = 0;
+
+void onAlarm(int)
+{
+    handler_calls++;
+    char* p = (char*)smalloc(256);
+    if(!p)
+    {
+        handler_failures++;
+        return;
+    }
+    memset(p, 0x5a, 256);
+    p = (char*)srealloc(p, 512);
+    if(!p || p[0] != 0x5a || p[255] != 0x5a)
+        handler_failures++;
+    sfree(p);
+}
+
+void* worker(void*)
+{
+    for(int i = 0; i < NUM_ITERATIONS; i++)
+    {
+        size_t size = (size_t)(i % 2000 + 1);
+        char* p = (char*)smalloc(size);
+        if(!p)
+        {
+            worker_failures++;
+            continue;
+        }
+        memset(p, 1, size);
+        p = (char*)srealloc(p, (size_t)(i % 3000 + 1));
+        if(!p || p[0] != 1)
+            worker_failures++;
+        sfree(p);
+    }
+    return nullptr;
+}
+
+// runs in the forked child, returns its exit code
+int childMain()
+{
+    signal(SIGALRM, SIG_DFL); // watchdog: a deadlocked child dies instead of hanging the test
+    alarm(CHILD_TIMEOUT_SEC);
+    for(int i = 0; i < 100; i++)
+    {
+        char* p = (char*)smalloc(100);
+        if(!p)
+            return 1;
+        memset(p, 2, 100);
+        sfree(p);
+    }
+    return 0;
+}
+
+int main()
+{
+    signal(SIGALRM, onAlarm);
+    struct itimerval timer = {{0, TIMER_USEC}, {0, TIMER_USEC}};
+    setitimer(ITIMER_REAL, &timer, nullptr);
+
+    pthread_t threads[NUM_THREADS];
+    for(int i = 0; i < NUM_THREADS; i++)
+        pthread_create(&threads[i], nullptr, worker, nullptr);
+
+    int failed_children = 0;
+    for(int i = 0; i < NUM_FORKS; i++)
+    {
+        pid_t pid = fork();
+        if(pid == 0)
+            _exit(childMain());
+        int status;
+        while(waitpid(pid, &status, 0) < 0) {} // interrupted by our own timer
+        if(!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            failed_children++;
+    }
+
+    for(int i = 0; i < NUM_THREADS; i++)
+        pthread_join(threads[i], nullptr);
+    struct itimerval off = {{0, 0}, {0, 0}};
+    setitimer(ITIMER_REAL, &off, nullptr);
+
+    printf("forks: %d, failed children: %d\n", NUM_FORKS, failed_children);
+    printf("signal handler calls: %d, failures: %d\n", (int)handler_calls, (int)handler_failures);
+    printf("worker failures: %d\n", (int)worker_failures);
+    bool ok = failed_children == 0 && handler_failures == 0 && worker_failures == 0;
+    printf("%s\n", ok ? "PASS" : "FAIL");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,74 @@
+// Growing-heap benchmark for malloc_3.cpp.
+//
+// Counts the sbrk calls the allocator makes, through the linker's --wrap, while
+// the heap only grows (1M small blocks that are never freed) and while it grows
+// and shrinks (rounds of 500 x 100 KB blocks allocated, then freed top down).
+// The second line is only interesting with trimming on, e.g.
+// SMALLOC_TRIM_THRESHOLD=1048576 ./malloc_3_grow_bench
+//
+// g++ -O2 -o malloc_3_grow_bench malloc_3_grow_bench.cpp malloc_3.cpp -lpthread -Wl,--wrap=sbrk
+
+#include "stdlib.h"
+#include "unistd.h"
+#include <cstdio>
+#include <cstdint>
+#include <chrono>
+
+#define NUM_SMALL 1000000
+#define NUM_LARGE 500
+#define LARGE_BLOCK_SIZE 100000
+#define NUM_ROUNDS 20
+
+void* smalloc(size_t size);
+void sfree(void* p);
+
+long sbrk_calls = 0;
+
+extern "C" void* __real_sbrk(intptr_t increment);
+extern "C" void* __wrap_sbrk(intptr_t increment)
+{
+    if(increment != 0) // sbrk(0) only reads the break
+        sbrk_calls++;
+    return __real_sbrk(increment);
+}
+
+double msSince(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main()
+{
+    auto start = std::chrono::steady_clock::now();
+    for(int i = 0; i < NUM_SMALL; i++)
+    {
+        char* p = (char*)smalloc((size_t)(i % 256 + 16));
+        if(!p)
+        {
+            printf("smalloc failed after %d blocks\n", i);
+            return 1;
+        }
+        p[0] = 1;
+    }
+    printf("grow:        %8.1f ms  sbrk calls %6ld\n", msSince(start), sbrk_calls);
+
+    static void* blocks[NUM_LARGE];
+    sbrk_calls = 0;
+    start = std::chrono::steady_clock::now();
+    for(int round = 0; round < NUM_ROUNDS; round++)
+    {
+        for(int i = 0; i < NUM_LARGE; i++)
+        {
+            blocks[i] = smalloc(LARGE_BLOCK_SIZE);
+            if(!blocks[i])
+            {
+                printf("smalloc(%d) failed\n", LARGE_BLOCK_SIZE);
+                return 1;
+            }
+        }
+        for(int i = NUM_LARGE - 1; i >= 0; i--)
+            sfree(blocks[i]);
+    }
+    printf("grow/shrink: %8.1f ms  sbrk calls %6ld\n", msSince(start), sbrk_calls);
+    return 0;
+}
@@ -0,0 +1,20 @@
+#!/bin/sh
+# Builds malloc_3_fit_bench against every build-time policy of malloc_3.cpp
+# and runs each one. Usage: ./malloc_3_sweep.sh [extra g++ flags]
+set -e
+cd "$(dirname "$0")"
+
+for config in \
+    "-DFIT_STRATEGY=BEST_FIT" \
+    "-DFIT_STRATEGY=FIRST_FIT" \
+    "-DFIT_STRATEGY=NEXT_FIT" \
+    "-DCORRUPTION_CHECKS=0" \
+    "-DCORRUPTION_CHECKS=0 -DHEAP_LOCKING=0" \
+    "-DLARGE_BLOCK=32" \
+    "-DLARGE_BLOCK=1024"
+do
+    g++ -O2 $config "$@" -o malloc_3_fit_bench malloc_3_fit_bench.cpp malloc_3.cpp -lpthread
+    printf "%-40s " "$config"
+    ./malloc_3_fit_bench
+done
+rm -f malloc_3_fit_bench